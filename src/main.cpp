@@ -1,5 +1,8 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <functional>
 #include <cmath>
 #include <cstdlib>
 #include <ctime>
@@ -16,6 +19,7 @@
 
 #define SHOWQUAD 0
 #define VORTEX 1
+#define LOOSENESS 2.0f
 
 float randomFloat(float min, float max) {
     float random = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
@@ -146,41 +150,71 @@ struct Rectangle {
 
     Rectangle(float x, float y, float w, float h) : x(x), y(y), w(w), h(h) {}
 
-    bool contains(Circle circle) {
+    bool contains(const Circle& circle) const {
         return (circle.Center.x >= x - w &&
                 circle.Center.x <= x + w &&
                 circle.Center.y >= y - h &&
                 circle.Center.y <= y + h);
     }
 
-    bool intersects(Rectangle range) {
+    // Whole circle, not just its center, lies inside the rectangle
+    bool fits(const Circle& circle) const {
+        return (circle.Center.x - circle.Radius >= x - w &&
+                circle.Center.x + circle.Radius <= x + w &&
+                circle.Center.y - circle.Radius >= y - h &&
+                circle.Center.y + circle.Radius <= y + h);
+    }
+
+    bool intersects(const Rectangle& range) const {
         return !(range.x - range.w > x + w ||
                 range.x + range.w < x - w ||
                 range.y - range.h > y + h ||
                 range.y + range.h < y - h);
     }
+
+    float distanceSquared(glm::vec2 point) const {
+        float dx = std::max(std::fabs(point.x - x) - w, 0.0f);
+        float dy = std::max(std::fabs(point.y - y) - h, 0.0f);
+        return dx * dx + dy * dy;
+    }
 };
 
+// Quadtree that indexes circles by their bounds instead of their centers.
+// Every node accepts circles that fit inside its boundary grown by LOOSENESS,
+// so a circle sinks to the deepest node matching its size and queries only
+// have to look at nodes whose loose boundary touches the query area.
 template<typename T>
-struct QuadTree {
+struct LooseQuadTree {
     Rectangle boundary;
+    Rectangle looseBoundary;
     unsigned long long capacity;
     std::vector<T> elements;
-    QuadTree<T>* northWest;
-    QuadTree<T>* northEast;
-    QuadTree<T>* southWest;
-    QuadTree<T>* southEast;
+    LooseQuadTree<T>* northWest;
+    LooseQuadTree<T>* northEast;
+    LooseQuadTree<T>* southWest;
+    LooseQuadTree<T>* southEast;
     bool divided;
-
-    QuadTree(Rectangle boundary, unsigned long long capacity) : 
-    boundary(boundary), capacity(capacity), divided(false) {}
-    
-    ~QuadTree() {
+    // Layout signature, kept on the root only: the debug overlay rewrites
+    // its outlines when either changes
+    size_t nodeCount;
+    unsigned long long layoutHash;
+
+    LooseQuadTree(Rectangle boundary, unsigned long long capacity) :
+    boundary(boundary),
+    looseBoundary(boundary.x, boundary.y, boundary.w * LOOSENESS, boundary.h * LOOSENESS),
+    capacity(capacity),
+    northWest(nullptr), northEast(nullptr), southWest(nullptr), southEast(nullptr),
+    divided(false), nodeCount(1), layoutHash(0) {}
+
+    ~LooseQuadTree() {
         clear();
     }
 
     void clear() {
         elements.clear();
+        nodeCount = 1;
+        layoutHash = 0;
+        looseBoundary = Rectangle(boundary.x, boundary.y, boundary.w * LOOSENESS, boundary.h * LOOSENESS);
         if (divided) {
             delete northWest;
             delete northEast;
@@ -191,99 +225,208 @@ struct QuadTree {
         }
     }
 
-    void subdivide() {
+    void subdivide(LooseQuadTree<T>& root) {
         Rectangle ne = Rectangle(boundary.x + boundary.w / 2, boundary.y - boundary.h / 2, boundary.w / 2, boundary.h / 2);
-        northEast = new QuadTree<T>(ne, capacity);
+        northEast = new LooseQuadTree<T>(ne, capacity);
 
         Rectangle nw = Rectangle(boundary.x - boundary.w / 2, boundary.y - boundary.h / 2, boundary.w / 2, boundary.h / 2);
-        northWest = new QuadTree<T>(nw, capacity);
+        northWest = new LooseQuadTree<T>(nw, capacity);
 
         Rectangle se = Rectangle(boundary.x + boundary.w / 2, boundary.y + boundary.h / 2, boundary.w / 2, boundary.h / 2);
-        southEast = new QuadTree<T>(se, capacity);
+        southEast = new LooseQuadTree<T>(se, capacity);
 
         Rectangle sw = Rectangle(boundary.x - boundary.w / 2, boundary.y + boundary.h / 2, boundary.w / 2, boundary.h / 2);
-        southWest = new QuadTree<T>(sw, capacity);
+        southWest = new LooseQuadTree<T>(sw, capacity);
         divided = true;
+
+        root.nodeCount += 4;
+        root.layoutHash += layoutKey();
+    }
+
+    // Summed over the divided nodes, so the hash doesn't depend on the order
+    // in which they were split
+    unsigned long long layoutKey() const {
+        std::hash<float> hash;
+        unsigned long long key = hash(boundary.x) ^ (hash(boundary.y) << 21) ^ (hash(boundary.w) << 42);
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    LooseQuadTree<T>* childFor(glm::vec2 point) {
+        if (point.x >= boundary.x) {
+            return point.y >= boundary.y ? southEast : northEast;
+        }
+        return point.y >= boundary.y ? southWest : northWest;
     }
 
     bool insert(T element) {
+        return insert(element, *this);
+    }
+
+    bool insert(T element, LooseQuadTree<T>& root) {
 
         if(!boundary.contains(*element)) {
             return false;
         }
 
-        if(elements.size() < capacity) {
-            elements.push_back(element);
-            return true;
-        } else {
-            if(!divided) {
-                subdivide();
-            }
-
-            if(northEast->insert(element)) {
-                return true;
-            } else if(northWest->insert(element)) {
-                return true;
-            } else if(southEast->insert(element)) {
-                return true;
-            } else if(southWest->insert(element)) {
+        if(!divided) {
+            if(elements.size() < capacity) {
+                keep(element);
                 return true;
             }
-            return false;
+            subdivide(root);
+        }
+
+        LooseQuadTree<T>* child = childFor(element->Center);
+        if(child->looseBoundary.fits(*element) && child->insert(element, root)) {
+            return true;
+        }
+
+        keep(element);
+        return true;
+    }
+
+    // Children only ever receive circles that fit their loose boundary, so
+    // growing it is only needed for oversized circles left at the root
+    void keep(T element) {
+        elements.push_back(element);
+        if(!looseBoundary.fits(*element)) {
+            float w = std::max(std::fabs(element->Center.x - looseBoundary.x) + element->Radius, looseBoundary.w);
+            float h = std::max(std::fabs(element->Center.y - looseBoundary.y) + element->Radius, looseBoundary.h);
+            looseBoundary = Rectangle(looseBoundary.x, looseBoundary.y, w, h);
         }
     }
 
-    void query(Rectangle range, std::vector<T>& found) {
-        if(!boundary.intersects(range)) {
+    // Calls visit(element) for every circle whose bounds intersect range
+    template<typename F>
+    void query(const Rectangle& range, const F& visit) const {
+        if(!looseBoundary.intersects(range)) {
             return;
-        } else {
-            for (auto& element : elements) {
-                if(range.contains(*element)) {
-                    found.push_back(element);
-                }
+        }
+
+        for (auto& element : elements) {
+            if(range.intersects(Rectangle(element->Center.x, element->Center.y, element->Radius, element->Radius))) {
+                visit(element);
             }
+        }
+
+        if(divided) {
+            northWest->query(range, visit);
+            northEast->query(range, visit);
+            southWest->query(range, visit);
+            southEast->query(range, visit);
+        }
+    }
+
+    // Calls visit(element) for every circle overlapping the disk at center
+    template<typename F>
+    void queryRadius(glm::vec2 center, float radius, const F& visit) const {
+        if(!looseBoundary.intersects(Rectangle(center.x, center.y, radius, radius))) {
+            return;
+        }
 
-            if(divided) {
-                northWest->query(range, found);
-                northEast->query(range, found);
-                southWest->query(range, found);
-                southEast->query(range, found);
+        for (auto& element : elements) {
+            glm::vec2 offset = element->Center - center;
+            float reach = radius + element->Radius;
+            if(glm::dot(offset, offset) < reach * reach) {
+                visit(element);
             }
         }
+
+        if(divided) {
+            northWest->queryRadius(center, radius, visit);
+            northEast->queryRadius(center, radius, visit);
+            southWest->queryRadius(center, radius, visit);
+            southEast->queryRadius(center, radius, visit);
+        }
     }
 
-    std::vector<GLfloat> getVertices() {
-        std::vector<GLfloat> vertices;
+    // Appends the k circles whose centers are closest to point, nearest first
+    void queryNearest(glm::vec2 point, size_t k, std::vector<T>& found) const {
+        if(k == 0) {
+            return;
+        }
 
-        float x1 = (boundary.x - boundary.w) / (WIDTH / 2.0f) - 1.0f;
-        float y1 = (boundary.y - boundary.h) / (HEIGHT / 2.0f) - 1.0f;
-        float x2 = (boundary.x + boundary.w) / (WIDTH / 2.0f) - 1.0f;
-        float y2 = (boundary.y - boundary.h) / (HEIGHT / 2.0f) - 1.0f;
-        float x3 = (boundary.x + boundary.w) / (WIDTH / 2.0f) - 1.0f;
-        float y3 = (boundary.y + boundary.h) / (HEIGHT / 2.0f) - 1.0f;
-        float x4 = (boundary.x - boundary.w) / (WIDTH / 2.0f) - 1.0f;
-        float y4 = (boundary.y + boundary.h) / (HEIGHT / 2.0f) - 1.0f;
+        std::vector<std::pair<float, T>> best;
+        best.reserve(k);
+        nearest(point, k, best);
 
-        vertices.push_back(x1); vertices.push_back(y1);
-        vertices.push_back(x2); vertices.push_back(y2);
-        vertices.push_back(x3); vertices.push_back(y3);
-        vertices.push_back(x4); vertices.push_back(y4);
+        std::sort_heap(best.begin(), best.end(), farther);
+        for (auto& candidate : best) {
+            found.push_back(candidate.second);
+        }
+    }
 
-        if (divided) {
-            auto nwVertices = northWest->getVertices();
-            vertices.insert(vertices.end(), nwVertices.begin(), nwVertices.end());
+    static bool farther(const std::pair<float, T>& a, const std::pair<float, T>& b) {
+        return a.first < b.first;
+    }
+
+    // Centers always lie inside the tight boundary, so it bounds the distance
+    // of everything below this node
+    void nearest(glm::vec2 point, size_t k, std::vector<std::pair<float, T>>& best) const {
+        if(best.size() == k && boundary.distanceSquared(point) >= best.front().first) {
+            return;
+        }
+
+        for (auto& element : elements) {
+            glm::vec2 offset = element->Center - point;
+            float distance = glm::dot(offset, offset);
+            if(best.size() < k) {
+                best.push_back(std::make_pair(distance, element));
+                std::push_heap(best.begin(), best.end(), farther);
+            } else if(distance < best.front().first) {
+                std::pop_heap(best.begin(), best.end(), farther);
+                best.back() = std::make_pair(distance, element);
+                std::push_heap(best.begin(), best.end(), farther);
+            }
+        }
+
+        if(divided) {
+            std::pair<float, LooseQuadTree<T>*> children[4] = {
+                std::make_pair(northWest->boundary.distanceSquared(point), northWest),
+                std::make_pair(northEast->boundary.distanceSquared(point), northEast),
+                std::make_pair(southWest->boundary.distanceSquared(point), southWest),
+                std::make_pair(southEast->boundary.distanceSquared(point), southEast)
+            };
+            std::sort(children, children + 4,
+                [](const std::pair<float, LooseQuadTree<T>*>& a, const std::pair<float, LooseQuadTree<T>*>& b) {
+                    return a.first < b.first;
+                });
+
+            for (auto& child : children) {
+                child.second->nearest(point, k, best);
+            }
+        }
+    }
 
-            auto neVertices = northEast->getVertices();
-            vertices.insert(vertices.end(), neVertices.begin(), neVertices.end());
+    // Writes every node outline in NDC as four GL_LINES segments (16 floats),
+    // flipping y to match projection, and returns the position past the last one
+    GLfloat* writeOutlines(GLfloat* out) const {
+        float left = (boundary.x - boundary.w) / (WIDTH / 2.0f) - 1.0f;
+        float right = (boundary.x + boundary.w) / (WIDTH / 2.0f) - 1.0f;
+        float top = 1.0f - (boundary.y - boundary.h) / (HEIGHT / 2.0f);
+        float bottom = 1.0f - (boundary.y + boundary.h) / (HEIGHT / 2.0f);
 
-            auto swVertices = southWest->getVertices();
-            vertices.insert(vertices.end(), swVertices.begin(), swVertices.end());
+        GLfloat segments[16] = {
+            left, top, right, top,
+            right, top, right, bottom,
+            right, bottom, left, bottom,
+            left, bottom, left, top
+        };
+        out = std::copy(segments, segments + 16, out);
 
-            auto seVertices = southEast->getVertices();
-            vertices.insert(vertices.end(), seVertices.begin(), seVertices.end());
+        if (divided) {
+            out = northWest->writeOutlines(out);
+            out = northEast->writeOutlines(out);
+            out = southWest->writeOutlines(out);
+            out = southEast->writeOutlines(out);
         }
 
-        return vertices;
+        return out;
     }
 };
 
@@ -319,9 +462,12 @@ GLuint VAO, VBO, EBO, PROG;
 std::vector<Circle> circles;
 glm::mat4 projection = glm::ortho(0.0f, static_cast<float>(WIDTH), static_cast<float>(HEIGHT), 0.0f);
 Rectangle boundary(WIDTH/2, HEIGHT/2, WIDTH/2, HEIGHT/2);
-QuadTree<Circle*> quadTree(boundary, 15);
+LooseQuadTree<Circle*> quadTree(boundary, 15);
 GLuint quadVAO, quadVBO, quadPROG;
-std::vector<GLfloat> quadVertices;
+GLsizeiptr quadCapacity = 0;
+GLsizei quadVertexCount = 0;
+size_t quadNodeCount = 0;
+unsigned long long quadLayoutHash = 0;
 std::mutex mtx;
 
 const char* quadVertSrc = R"(
@@ -350,19 +496,53 @@ void updateCircles(std::vector<Circle>& circles, float deltaTime, size_t start,
     }
 }
 
-void checkCollisions(std::vector<Circle>& circles, QuadTree<Circle*>& quadTree, size_t start, size_t end) {
+void checkCollisions(std::vector<Circle>& circles, LooseQuadTree<Circle*>& quadTree, size_t start, size_t end) {
     for (size_t i = start; i < end; ++i) {
-        std::vector<Circle*> possibleCollisions;
-        Rectangle range(circles[i].Center.x, circles[i].Center.y, circles[i].Radius * 2, circles[i].Radius * 2);
-        quadTree.query(range, possibleCollisions);
-        for (auto& other : possibleCollisions) {
-            if (&circles[i] != other) {
-                circles[i].colides(*other);
+        Circle& circle = circles[i];
+        quadTree.queryRadius(circle.Center, circle.Radius, [&circle](Circle* other) {
+            if (&circle != other) {
+                circle.colides(*other);
             }
+        });
+    }
+}
+
+#if SHOWQUAD == 1
+
+void updateQuadOutlines() {
+    if (quadTree.nodeCount == quadNodeCount && quadTree.layoutHash == quadLayoutHash) {
+        return;
+    }
+    quadNodeCount = quadTree.nodeCount;
+    quadLayoutHash = quadTree.layoutHash;
+
+    GLsizeiptr size = quadNodeCount * 16 * sizeof(GLfloat);
+
+    glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+    if (size > quadCapacity) {
+        quadCapacity = std::max(size, quadCapacity * 2);
+        glBufferData(GL_ARRAY_BUFFER, quadCapacity, nullptr, GL_STREAM_DRAW);
+    }
+
+    GLfloat* out = static_cast<GLfloat*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    if (out) {
+        GLfloat* end = quadTree.writeOutlines(out);
+        quadVertexCount = static_cast<GLsizei>((end - out) / 2);
+        if (glUnmapBuffer(GL_ARRAY_BUFFER) == GL_FALSE) {
+            std::cerr << "Error unmapping quadtree buffer\n";
+            quadVertexCount = 0;
+            quadNodeCount = 0;
         }
+    } else {
+        std::cerr << "Error mapping quadtree buffer\n";
+        quadVertexCount = 0;
+        quadNodeCount = 0;
     }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
+#endif
+
 void init() {
 
     // Shaders
@@ -481,8 +661,8 @@ void init() {
         glGenBuffers(1, &quadVBO);
         glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
 
-        quadVertices = quadTree.getVertices();
-        glBufferData(GL_ARRAY_BUFFER, quadVertices.size() * sizeof(float), quadVertices.data(), GL_STATIC_DRAW);
+        quadCapacity = NUM * 16 * sizeof(GLfloat);
+        glBufferData(GL_ARRAY_BUFFER, quadCapacity, nullptr, GL_STREAM_DRAW);
         glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
         glEnableVertexAttribArray(0);
 
@@ -578,20 +758,12 @@ void render(float deltaTime, GLFWwindow* myWindow) {
     // Rendering quadtree boundaries
 
     #if SHOWQUAD == 1
-    static std::vector<GLfloat> lastQuadVertices;
-    std::vector<GLfloat> currentQuadVertices = quadTree.getVertices();
-
-    if (currentQuadVertices != lastQuadVertices) {
-        lastQuadVertices = currentQuadVertices;
-        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
-        glBufferData(GL_ARRAY_BUFFER, currentQuadVertices.size() * sizeof(float), currentQuadVertices.data(), GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
-    }
+    updateQuadOutlines();
 
     glUseProgram(quadPROG);
     glBindVertexArray(quadVAO);
     glLineWidth(2.0f);
-        glDrawArrays(GL_LINE_LOOP, 0, currentQuadVertices.size() / 2);
+        glDrawArrays(GL_LINES, 0, quadVertexCount);
     glBindVertexArray(0);
     glUseProgram(0);
     #endif